@@ -1,14 +1,84 @@
 #include "utilities.h"
+#include <sys/un.h>
+#include <poll.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY     60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY    0x4000000
+#endif
 
 //maximum number of times a packet is re-trasmitted
 #define MAXRETRANS  3
+#define RETRANS_TIMEOUT  3    //seconds to wait for an ack before retransmitting
+#define END_MAXRETRANS   40   //the end request is acked once the file is durable, which may take a sync of the whole filesystem
+#define PROBE_MIN   100       //first zero window probe interval in ms, doubled up to RETRANS_TIMEOUT
+
+#define RING_SLOTS  (4 * RECV_WINDOW) //chunks read ahead of the network, power of two
+#define READAHEAD   (1 << 20)       //bytes the kernel is asked to read ahead of the reader thread
+#define CACHELINE   64
+#define ZC_IDS      (2 * RING_SLOTS) //zero copy sends which may wait for their completion at once
+
+static struct hdr sendhdr, recvhdr; //headers of the last request and response
 
-//header for DG
-static struct hdr {
-	uint32_t      opcode;         //operation code
-	uint32_t      seq;    /* sequence # */
-	uint32_t      ts;             /* timestamp when sent */
-} sendhdr, recvhdr;
+//chunk of the file. It is sent straight from here and kept until it is acknowledged
+struct chunk {
+	struct hdr  hdr;
+	char        *ptr;           //data to send, data below or the file mapping in zero copy mode
+	size_t      len;            //length of data
+	char        data[MAXLINE];  //file data
+} __attribute__((aligned(CACHELINE)));
+
+//Single producer single consumer ring between the reader thread, which fills
+//chunks from the file, and the network thread, which sends them. Each index is
+//written by one thread only and sits on its own cache line. A thread which
+//finds the ring full or empty sleeps on its eventfd, and is only woken when it
+//says it is waiting, so the hand over costs no system call while both keep up.
+//The waiting flags are written by both threads, so each has a line of its own
+//and setting one does not pull an index away from the thread writing it.
+static struct ring {
+	struct chunk        slots[RING_SLOTS];
+	_Atomic uint32_t    head __attribute__((aligned(CACHELINE))); //chunks read, written by the reader
+	_Atomic int         done;           //reader reached end of file (1) or failed (-1)
+	_Atomic uint32_t    tail __attribute__((aligned(CACHELINE))); //chunks acked, written by the network thread
+	_Atomic int         stop;           //network thread gave up, reader should exit
+	_Atomic int         senderWaiting __attribute__((aligned(CACHELINE))); //network thread sleeps on senderEvent
+	_Atomic int         readerWaiting __attribute__((aligned(CACHELINE))); //reader thread sleeps on readerEvent
+	int                 senderEvent __attribute__((aligned(CACHELINE)));
+	int                 readerEvent;
+	int                 fd;             //file being read
+	pthread_t           reader;
+	char                *map;           //file mapping in zero copy mode, no reader thread then
+	size_t              mapLen;
+} ring;
+
+//Zero copy send mode (-z) -
+//The file is mapped and chunks are sent straight from the mapping with
+//MSG_ZEROCOPY, so the data is never copied by the cpu. The kernel keeps the
+//pages pinned until it reports the send complete on the socket error queue.
+//Until then neither the mapping nor the header of the chunk may change, so
+//completions are counted per ring slot. Without SO_ZEROCOPY support, or when
+//the kernel reports it copied anyway, chunks are sent from the mapping with
+//a normal send.
+static int zeroCopy = 0; //-z given
+
+static struct zerocopy {
+	int         enabled;            //socket takes MSG_ZEROCOPY
+	uint32_t    nextid;             //id of the next zero copy send on the socket
+	uint32_t    pending;            //zero copy sends not completed yet
+	uint16_t    slot[ZC_IDS];       //ring slot of each pending send, by id
+	uint16_t    refs[RING_SLOTS];   //pending sends per ring slot
+} zc;
 
 static void     sig_alrm(int signo);
 static sigjmp_buf       jmpbuf;
@@ -32,6 +102,7 @@ ssize_t dg_send_recv(int opcode, int fd, void *outbuff, size_t outbytes,
 	struct iovec    iovsend[2], iovrecv[2];
 	time_t curr_ts;  // current timestamp
 	int retrans = 0; //retransmit counter
+	int maxretrans = (opcode == END) ? END_MAXRETRANS : MAXRETRANS;
 
 	//populate sending data structures
 	sendhdr.seq++;
@@ -64,12 +135,12 @@ ssize_t dg_send_recv(int opcode, int fd, void *outbuff, size_t outbytes,
 	curr_ts = time(NULL); //current system time
 	sendhdr.ts = curr_ts;
 	Sendmsg(fd, &msgsend, 0);
-	alarm(3); //set alarm to 3 seconds
+	alarm(RETRANS_TIMEOUT); //set alarm to 3 seconds
 
 
 	if (sigsetjmp(jmpbuf, 1) != 0) {
 		//if MAXRETRANS number of retransmissions have happened then exit.
-		if (++retrans >= MAXRETRANS) {
+		if (++retrans >= maxretrans) {
 #ifdef DEBUGTRACE
 			printf("\ndg_send_recv: no response from server, giving up");
 #endif
@@ -90,7 +161,7 @@ ssize_t dg_send_recv(int opcode, int fd, void *outbuff, size_t outbytes,
 #ifdef DEBUGTRACE
 		printf("recv %4d\n", recvhdr.seq);
 #endif
-	} while (n < sizeof(struct hdr) || recvhdr.seq != sendhdr.seq);
+	} while (n < sizeof(struct hdr) || recvhdr.opcode != ACK || recvhdr.seq != sendhdr.seq);
 
 	alarm(0);                       /* stop SIGALRM timer */
 
@@ -106,84 +177,1144 @@ static void sig_alrm(int signo)
 	siglongjmp(jmpbuf, 1);
 }
 
-/*sendAndRecvData -
- * This function is responsible for sending and receiving data from the server
- * opcode - operation code can be WriteReq, DATA, ACK, END
- * fd - socket on which the requests to the destination are sent
- * outbuff - Buffer which holds the data to be sent
- * outbytes - length of data to be sent form the Buffer.
+//current time in milliseconds, for the send window timers
+static long long nowMs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
+}
+
+/*sendPacket -
+ * Sends a header and its data without waiting for an ack
+ * fd - socket on which the packet is sent
+ * hdr - header of the packet
+ * data - data following the header
+ * len - length of data
  * destaddr - destination address
  * destlen - destination address length
- * recvaddr - the address from which the response from the destination comes
- * recvaddrlen - recvaddr length
  */
-ssize_t sendAndRecvData(int opcode, int fd, void *outbuff, size_t outbytes,
-		struct sockaddr *destaddr, socklen_t destlen,
-		struct sockaddr *recvaddr, socklen_t recvaddrlen)
+static void sendPacket(int fd, struct hdr *hdr, void *data, size_t len,
+		struct sockaddr *destaddr, socklen_t destlen)
+{
+	struct msghdr   msg;
+	struct iovec    iov[2];
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = destaddr;
+	msg.msg_namelen = destlen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(struct hdr);
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+
+	hdr->ts = time(NULL);
+	Sendmsg(fd, &msg, 0);
+}
+
+//wakes a thread sleeping on its eventfd if it said it is waiting
+static void wakeThread(_Atomic int *waiting, int event)
+{
+	if (atomic_exchange(waiting, 0))
+		eventfd_write(event, 1);
+}
+
+/*readerThread -
+ * Reads the file into the ring ahead of the network thread. The kernel is
+ * told the file is read sequentially and asked to read ahead of the reader,
+ * so cold reads overlap with sending instead of stalling it.
+ */
+static void *readerThread(void *arg)
+{
+	uint32_t        head = 0;       //only this thread writes ring.head
+	off_t           offset = 0, advised = 0;
+	struct chunk    *c;
+	eventfd_t       count;
+	ssize_t         n;
+
+	posix_fadvise(ring.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	for ( ; ; ) {
+		//wait for the network thread to free a chunk
+		while (head - atomic_load(&ring.tail) == RING_SLOTS && !atomic_load(&ring.stop)) {
+			atomic_store(&ring.readerWaiting, 1);
+			if (head - atomic_load(&ring.tail) == RING_SLOTS && !atomic_load(&ring.stop))
+				eventfd_read(ring.readerEvent, &count);
+			atomic_store(&ring.readerWaiting, 0);
+		}
+		if (atomic_load(&ring.stop))
+			return(NULL);
+
+		//keep the kernel a full READAHEAD ahead of what we read
+		while (offset + READAHEAD > advised) {
+			posix_fadvise(ring.fd, advised, READAHEAD, POSIX_FADV_WILLNEED);
+			advised += READAHEAD;
+		}
+
+		c = &ring.slots[head % RING_SLOTS];
+		while ( (n = pread(ring.fd, c->data, MAXLINE, offset)) < 0 && errno == EINTR)
+			;
+		if (n <= 0) {
+			//end of file, or a read error the network thread reports
+			atomic_store(&ring.done, n == 0 ? 1 : -1);
+			wakeThread(&ring.senderWaiting, ring.senderEvent);
+			return(NULL);
+		}
+		c->ptr = c->data;
+		c->len = n;
+		offset += n;
+
+		//publish the chunk
+		atomic_store(&ring.head, ++head);
+		wakeThread(&ring.senderWaiting, ring.senderEvent);
+	}
+}
+
+/*startReader -
+ * Starts the reader thread on a file
+ * fd - file to read
+ */
+static void startReader(int fd)
+{
+	static int  events = 0; //eventfds are created once and reused for every file
+	sigset_t    all, old;
+
+	if (!events) {
+		if ( (ring.senderEvent = eventfd(0, EFD_NONBLOCK)) < 0 ||
+				(ring.readerEvent = eventfd(0, 0)) < 0)
+			bail("eventfd error");
+		events = 1;
+	}
+	ring.fd = fd;
+	atomic_store(&ring.head, 0);
+	atomic_store(&ring.tail, 0);
+	atomic_store(&ring.done, 0);
+	atomic_store(&ring.stop, 0);
+
+	//the reader must never take the retransmit alarm of the network thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	errno = pthread_create(&ring.reader, NULL, readerThread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (errno != 0)
+		bail("pthread_create error");
+}
+
+/*stopReader -
+ * Stops the reader thread and waits for it to exit
+ */
+static void stopReader(void)
+{
+	atomic_store(&ring.stop, 1);
+	eventfd_write(ring.readerEvent, 1);
+	pthread_join(ring.reader, NULL);
+}
+
+/*enableZeroCopy -
+ * Turns on MSG_ZEROCOPY for a socket. Sends fall back to copying when the
+ * kernel does not support it.
+ * sockfd - socket the file data is sent on
+ */
+static void enableZeroCopy(int sockfd)
+{
+	int one = 1;
+
+	zc.enabled = setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#ifdef DEBUGTRACE
+	printf("Zero copy %s\n", zc.enabled ? "enabled" : "not supported, copying");
+#endif
+}
+
+/*reapZeroCopy -
+ * Collects zero copy completions from the socket error queue and releases
+ * the ring slots they held.
+ * sockfd - socket the file data is sent on
+ * wait - block until at least one completion arrives
+ */
+static void reapZeroCopy(int sockfd, int wait)
+{
+	struct msghdr               msg;
+	struct cmsghdr              *cm;
+	struct sock_extended_err    *serr;
+	struct pollfd               pfd;
+	char                        control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+										sizeof(struct sockaddr_in))];
+	uint32_t                    id;
+
+	pfd.fd = sockfd;
+	pfd.events = 0; //the error queue is always reported as POLLERR
+
+	for ( ; ; ) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(sockfd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				bail("recvmsg MSG_ERRQUEUE error");
+			if (!wait)
+				return;
+			if (poll(&pfd, 1, MAXRETRANS * RETRANS_TIMEOUT * 1000) == 0)
+				bail("zero copy completion timeout");
+			continue;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR)
+				continue;
+			serr = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+				continue;
+			//ids ee_info to ee_data are complete
+			for (id = serr->ee_info; id != serr->ee_data + 1; id++) {
+				zc.refs[zc.slot[id % ZC_IDS]]--;
+				zc.pending--;
+			}
+			//the device could not send from our pages, pinning them only costs
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zc.enabled = 0;
+		}
+		wait = 0;
+	}
+}
+
+/*sendChunk -
+ * Sends a chunk of the ring. In zero copy mode it is sent from the file
+ * mapping, with MSG_ZEROCOPY while the socket takes it.
+ * sockfd - socket on which the chunk is sent
+ * slot - ring slot of the chunk
+ * destaddr - destination address
+ * destlen - destination address length
+ */
+static void sendChunk(int sockfd, uint32_t slot, struct sockaddr *destaddr, socklen_t destlen)
+{
+	struct chunk    *c = &ring.slots[slot];
+	struct hdr      copy;
+	struct msghdr   msg;
+	struct iovec    iov[2];
+
+	//a retransmission whose header is still pinned by the first send goes
+	//out as a copy, the pinned header must not change
+	if (zc.refs[slot] > 0) {
+		copy = c->hdr;
+		sendPacket(sockfd, &copy, c->ptr, c->len, destaddr, destlen);
+		return;
+	}
+	if (ring.map == NULL || !zc.enabled) {
+		sendPacket(sockfd, &c->hdr, c->ptr, c->len, destaddr, destlen);
+		return;
+	}
+
+	//the kernel numbers zero copy sends, make sure the id has a free entry
+	while (zc.pending == ZC_IDS)
+		reapZeroCopy(sockfd, 1);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = destaddr;
+	msg.msg_namelen = destlen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	iov[0].iov_base = &c->hdr;
+	iov[0].iov_len = sizeof(struct hdr);
+	iov[1].iov_base = c->ptr;
+	iov[1].iov_len = c->len;
+	c->hdr.ts = time(NULL);
+
+	if (sendmsg(sockfd, &msg, MSG_ZEROCOPY) == sizeof(struct hdr) + c->len) {
+		zc.slot[zc.nextid++ % ZC_IDS] = slot;
+		zc.refs[slot]++;
+		zc.pending++;
+		return;
+	}
+	//out of memory to pin pages, send this one with a copy
+	if (errno != ENOBUFS)
+		bail("sendmsg error");
+	Sendmsg(sockfd, &msg, 0);
+}
+
+/*mapFile -
+ * Maps a file for zero copy mode and publishes all its chunks in the ring
+ * at once, in place of the reader thread.
+ * fd - file to send
+ * Returns 0 on success and -1 if the file cannot be mapped.
+ */
+static int mapFile(int fd)
 {
-	ssize_t n; //number of bytes of data received from server
+	struct stat st;
+	void        *map;
 
-	//send and receive data grams
-	n = dg_send_recv(opcode, fd, outbuff, outbytes,
-			destaddr, destlen, recvaddr, recvaddrlen);
-	if (n < 0)
-		bail("sendAndRecvData error");
+	//an empty file cannot be mapped, the reader thread handles it
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+		return(-1);
+	if ( (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		return(-1);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	madvise(map, st.st_size, MADV_WILLNEED);
 
-	return(n);
+	ring.map = map;
+	ring.mapLen = st.st_size;
+	atomic_store(&ring.head, (st.st_size + MAXLINE - 1) / MAXLINE);
+	atomic_store(&ring.tail, 0);
+	atomic_store(&ring.done, 1);
+	return(0);
+}
+
+/*unmapFile -
+ * Waits for the kernel to release the pages of the mapping and unmaps it
+ * sockfd - socket the file data was sent on
+ */
+static void unmapFile(int sockfd)
+{
+	while (zc.pending > 0)
+		reapZeroCopy(sockfd, 1);
+	munmap(ring.map, ring.mapLen);
+	ring.map = NULL;
 }
 
 /*readAndSendFileData -
- * Reads a file line by line and sends that data to the server
- * fp - File which needs to be read and sent to the server
+ * Sends the file data the reader thread puts in the ring to the server.
+ * Up to the window advertised by the server is sent ahead of the acks. When
+ * the server closes the window the client probes it until it opens again.
  * sockfd - socket on which we are sending data to server
  * pservaddr - server address
  * servlen - server address length
+ * rwnd - window advertised in the ack of the write request
+ * Returns 0 on success and -1 if the server stopped responding or the file could not be read.
  */
 
-void readAndSendFileData(FILE *fp, int sockfd, struct sockaddr *pservaddr, socklen_t servlen)
+int readAndSendFileData(int sockfd, struct sockaddr *pservaddr, socklen_t servlen,
+		uint32_t rwnd)
 {
-	ssize_t n; //number of bytes of data received from server
-	char    sendline[MAXLINE]; //Buffer to hold data read from the file
+	uint32_t        first = sendhdr.seq + 1; //sequence number of the first chunk
+	uint32_t        base = first;            //oldest packet not acknowledged
+	uint32_t        next = first;            //next packet to send
+	struct chunk    *c;
+	struct hdr      ackhdr, probehdr;
+	struct pollfd   pfd[2];
+	long long       now, lastack, timer;    //timer is when the retransmit or probe timer started
+	int             eof = 0, done, starved, probe = PROBE_MIN, timeout, timed;
+	eventfd_t       count;
+	ssize_t         n;
 
-	//Keep reading the file until end of file
-	while (Fgets(sendline, MAXLINE, fp) != NULL) {
+	pfd[0].fd = sockfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ring.senderEvent;
+	pfd[1].events = POLLIN;
+	lastack = timer = nowMs();
 
+	for ( ; ; ) {
+		//Keep sending what the reader has read while the window allows
+		starved = 0;
+		while (!eof && next - base < rwnd && next - base < RECV_WINDOW) {
+			if (next - first == atomic_load(&ring.head)) {
+				if ( (done = atomic_load(&ring.done)) == 0) {
+					starved = 1;
+					break;
+				}
+				//the reader publishes its last chunk before done, look again
+				if (next - first != atomic_load(&ring.head))
+					continue;
+				if (done < 0) {
+					//a later request must not reuse the number of a data packet sent
+					sendhdr.seq = next - 1;
+					return(-1);
+				}
+				eof = 1;
+				break;
+			}
+			c = &ring.slots[(next - first) % RING_SLOTS];
+			if (ring.map != NULL) {
+				c->ptr = ring.map + (size_t) (next - first) * MAXLINE;
+				c->len = ring.mapLen - (size_t) (next - first) * MAXLINE;
+				if (c->len > MAXLINE)
+					c->len = MAXLINE;
+			}
 #ifdef DEBUGTRACE
-		printf("Size of sendline=%ld\n",strlen(sendline));
+			printf("Size of chunk=%ld\n",c->len);
 #endif
-		//send data read from the file to ther server
-		n = sendAndRecvData(DATA, sockfd, sendline, strlen(sendline),
-				pservaddr, servlen, NULL, 0);
+			if (next == base)
+				timer = lastack = nowMs();
+			//a zero copy send may still hold the header of this slot
+			while (zc.refs[(next - first) % RING_SLOTS] > 0)
+				reapZeroCopy(sockfd, 1);
+			c->hdr.opcode = DATA;
+			c->hdr.seq = next++;
+			//send data read from the file to ther server
+			sendChunk(sockfd, (next - 1 - first) % RING_SLOTS, pservaddr, servlen);
+		}
+
+		//whole file acknowledged
+		if (eof && base == next)
+			break;
+
+		//the reader is behind, sleep until it publishes more
+		if (starved) {
+			atomic_store(&ring.senderWaiting, 1);
+			if (next - first != atomic_load(&ring.head) || atomic_load(&ring.done)) {
+				atomic_store(&ring.senderWaiting, 0);
+				continue;
+			}
+		}
+
+		//wait for an ack until the retransmit timer, or the probe timer on a closed window, fires
+		now = nowMs();
+		timed = 1;
+		if (base != next)
+			timeout = timer + RETRANS_TIMEOUT * 1000 - now;
+		else if (rwnd == 0)
+			timeout = timer + probe - now;
+		else {
+			timed = 0; //only waiting for the disk
+			timeout = -1;
+		}
+		//a timer already due fires now
+		if (timed && timeout < 0)
+			timeout = 0;
+		if (poll(pfd, starved ? 2 : 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			bail("poll error");
+		}
+		if (starved) {
+			atomic_store(&ring.senderWaiting, 0);
+			if (pfd[1].revents & POLLIN)
+				eventfd_read(ring.senderEvent, &count);
+		}
+
+		//zero copy completions
+		if (pfd[0].revents & POLLERR)
+			reapZeroCopy(sockfd, 0);
+
+		if (pfd[0].revents & POLLIN) {
+			n = recv(sockfd, &ackhdr, sizeof(ackhdr), 0);
+			//ignore anything but acks for this window
+			if (n < (ssize_t) sizeof(ackhdr) || ackhdr.opcode != ACK ||
+					ackhdr.seq + 1 < base || ackhdr.seq >= next)
+				continue;
+#ifdef DEBUGTRACE
+			printf("recv ack %4d win %d\n", ackhdr.seq, ackhdr.win);
+#endif
+			now = lastack = nowMs();
+			rwnd = ackhdr.win;
+			if (ackhdr.seq >= base) {
+				base = ackhdr.seq + 1;
+				timer = now;
+				//hand the acknowledged chunks back to the reader
+				atomic_store(&ring.tail, base - first);
+				wakeThread(&ring.readerWaiting, ring.readerEvent);
+			}
+			if (base == next) {
+				probe = PROBE_MIN;
+				timer = now;
+			}
+			continue;
+		}
+
+		//woken by the reader
+		if (!timed || nowMs() < timer + (base != next ? RETRANS_TIMEOUT * 1000 : probe))
+			continue;
+
+		//timer fired
+		now = nowMs();
+		if (now - lastack >= MAXRETRANS * RETRANS_TIMEOUT * 1000) {
+#ifdef DEBUGTRACE
+			printf("\nreadAndSendFileData: no response from server, giving up");
+#endif
+			errno = ETIMEDOUT;
+			sendhdr.seq = next - 1;
+			return(-1);
+		}
+		timer = now;
+
+		if (base == next) {
+			//window is closed, ask the server whether it opened again
+			memset(&probehdr, 0, sizeof(probehdr));
+			probehdr.opcode = PROBE;
+			probehdr.seq = base - 1;
+			sendPacket(sockfd, &probehdr, NULL, 0, pservaddr, servlen);
+			if ( (probe *= 2) > RETRANS_TIMEOUT * 1000)
+				probe = RETRANS_TIMEOUT * 1000;
+			continue;
+		}
+
+#ifdef DEBUGTRACE
+		printf("\n readAndSendFileData: timeout, retransmitting %d packets", next - base);
+#endif
+		//retransmit the whole window, the server keeps what it already has
+		for (n = base; n != next; n++)
+			sendChunk(sockfd, (n - first) % RING_SLOTS, pservaddr, servlen);
 	}
+
+	//the end request follows the last data packet
+	sendhdr.seq = next - 1;
+	return(0);
 }
 
 /*sendFileOperationReq -
- * Sends the file operation request namely Write Req or End req to the server
+ * Sends the file operation request namely Write Req, End or Close req to the server
  * opcode - operation code is set by the caller
  * fileName - filename on which the operation is requested
+ * len - length of the request data, more than the filename for a write request
  * sockfd - socket on which the requests to the server are sent
  * pservaddr - server address
  * servlen - server address length
  * recvaddr - the address from which the response from server is received
  * recvaddrlen - recvaddr length
+ * Returns 0 on success and -1 if the server stopped responding.
  */
-void sendFileOperationReq(int opcode, char *fileName, int sockfd,
+int sendFileOperationReq(int opcode, char *fileName, size_t len, int sockfd,
 		struct sockaddr *pservaddr, socklen_t servlen,
 		struct sockaddr *recvaddr, socklen_t recvaddrlen)
 {
-	ssize_t n; //number of bytes of data received from server
-
 #ifdef DEBUGTRACE
 	printf("Size of Filename=%ld\n",strlen(fileName));
 #endif
-	n = sendAndRecvData(opcode, sockfd, fileName, strlen(fileName),
-			pservaddr, servlen, recvaddr, recvaddrlen);
+	if (dg_send_recv(opcode, sockfd, fileName, len,
+			pservaddr, servlen, recvaddr, recvaddrlen) < 0)
+		return(-1);
+	return(0);
+}
+
+/*transferFile -
+ * Transfers one file: write request, file data and end request.
+ * For a new session destaddr is the server listening address and sessaddr
+ * is filled with the address of the server child handling the session.
+ * For a warm session destaddr and sessaddr are both the session address.
+ * fp - File which needs to be sent
+ * fileName - name under which the server stores the file
+ * sockfd - socket on which the requests to the server are sent
+ * destaddr - address the write request is sent to
+ * destlen - destaddr length
+ * sessaddr - session address, used for the file data and end request
+ * sesslen - sessaddr length
+ * Returns 0 on success and -1 if the server stopped responding.
+ */
+int transferFile(FILE *fp, char *fileName, int sockfd,
+		struct sockaddr *destaddr, socklen_t destlen,
+		struct sockaddr *sessaddr, socklen_t sesslen)
+{
+	char        req[MAXLINE];   //write request, the filename and the file size
+	struct stat st;
+	int         rc, mapped, len;
+
+	//the server preallocates the file with the size following the name
+	if (fstat(fileno(fp), &st) < 0 ||
+			(len = snprintf(req, sizeof(req), "%s%c%lld", fileName, 0, (long long) st.st_size)) >= sizeof(req))
+		return(-1);
+
+	//start reading the file while the write request is under way.
+	//Zero copy mode sends from a mapping of the file instead
+	if (! (mapped = zeroCopy && mapFile(fileno(fp)) == 0))
+		startReader(fileno(fp));
+
+	//send file transfer request to the server with the filename
+	//Use the the address received with the write request ack to send following packets,
+	//starting with the window the server advertised in that ack
+	rc = sendFileOperationReq(WRITEREQ, req, len, sockfd, destaddr, destlen,
+			sessaddr, sesslen);
+	if (rc == 0)
+		rc = readAndSendFileData(sockfd, sessaddr, sesslen, recvhdr.win);
+
+	if (mapped)
+		unmapFile(sockfd);
+	else
+		stopReader();
+	if (rc < 0)
+		return(-1);
+
+	//send file end request to the server
+	return(sendFileOperationReq(END, fileName, strlen(fileName), sockfd, sessaddr, sesslen, NULL, 0));
+}
+
+/*closeSession -
+ * Tells the server child that no more files are coming on this session.
+ * The request is sent once and not acked. If it gets lost the server child
+ * times the session out on its own, and a retransmission could only reach
+ * a child which already exited.
+ * sockfd - socket on which the requests to the server are sent
+ * sessaddr - session address
+ * sesslen - sessaddr length
+ */
+void closeSession(int sockfd, struct sockaddr *sessaddr, socklen_t sesslen)
+{
+	struct hdr  closehdr;
+
+	memset(&closehdr, 0, sizeof(closehdr));
+	closehdr.opcode = CLOSE;
+	closehdr.seq = ++sendhdr.seq;
+	sendPacket(sockfd, &closehdr, NULL, 0, sessaddr, sesslen);
+}
+
+/*
+ * Client daemon -
+ * Keeps sessions to servers warm so that queued files pay only for a write
+ * request instead of a process start and a new server child each.
+ * 1. The daemon listens for jobs on a local unix socket. Every job is one
+ *    message "<priority>\t<ip:port>\t<local path>\t<remote name>" and is
+ *    answered with "OK <remote name>" or "FAIL <remote name>" when done.
+ * 2. Queued jobs run highest priority first, in arrival order within a priority.
+ * 3. A fixed number of worker processes run the jobs, which is the concurrency limit.
+ *    Each worker keeps its own sessions, and jobs are given to a worker which
+ *    last talked to the same server when one is idle.
+ */
+#define DAEMON_SOCK  "/tmp/fclientd.sock" //default unix socket the daemon listens on
+#define MAXWORKERS   64   //maximum number of concurrent transfers
+#define MAXSESSIONS  16   //warm sessions kept by each worker
+#define MAXJOBS      1024 //maximum number of queued and running jobs
+#define MAXCONNS     256  //maximum number of connected job submitters
+#define SESSION_GUARD 5   //seconds before the server idle timeout we stop trusting a session
+
+//job handed from the daemon to a worker
+struct job {
+	int                 id;          //slot in the daemon job table
+	struct sockaddr_in  servaddr;    //server listening address
+	char                localName[PATH_MAX]; //file to read
+	char                remoteName[MAXLINE]; //name the server stores the file under
+};
+
+//result handed back from a worker to the daemon
+struct jobresult {
+	int     id;
+	int     status; //0 on success, -1 on failure
+};
+
+//warm session kept by a worker
+struct session {
+	struct sockaddr_in  servaddr;  //server listening address
+	struct sockaddr_in  sessaddr;  //server child address
+	time_t              lastused;  //time of the last packet acked on the session
+	int                 active;
+};
+
+//job slot in the daemon
+static struct jobslot {
+	int                 used;
+	int                 running;
+	int                 prio;
+	unsigned long       order;  //arrival order, tie breaker within a priority
+	int                 conn;   //submitter waiting for the result
+	struct job          job;
+} jobs[MAXJOBS];
+
+//worker process as seen by the daemon
+static struct worker {
+	pid_t               pid;
+	int                 fd;      //socket to the worker process
+	int                 job;     //running job or -1 when idle
+	struct sockaddr_in  lastserv; //server of the last job, used for session affinity
+} workers[MAXWORKERS];
+
+//connected job submitter
+static struct conn {
+	int     fd;
+	int     pending; //jobs not answered yet
+	int     eof;     //submitter sent all its jobs
+} conns[MAXCONNS];
+
+static struct session sessions[MAXSESSIONS]; //sessions of this worker
+
+/*findSession -
+ * Returns the session to a server, taking over the least recently used
+ * slot when there is none. An evicted session is closed on the server.
+ * sockfd - socket the worker talks to the servers on
+ * servaddr - server listening address
+ */
+static struct session *findSession(int sockfd, struct sockaddr_in *servaddr)
+{
+	struct session *s, *lru = &sessions[0];
+
+	for (s = sessions; s < sessions + MAXSESSIONS; s++)
+	{
+		if (s->active && s->servaddr.sin_addr.s_addr == servaddr->sin_addr.s_addr &&
+				s->servaddr.sin_port == servaddr->sin_port)
+			return(s);
+		if (!s->active || (lru->active && s->lastused < lru->lastused))
+			lru = s;
+	}
+
+	if (lru->active)
+		closeSession(sockfd, (struct sockaddr *) &lru->sessaddr, sizeof(lru->sessaddr));
+	bzero(lru, sizeof(*lru));
+	lru->servaddr = *servaddr;
+	return(lru);
+}
+
+/*runJob -
+ * Transfers the file of a job, on a warm session when there is one.
+ * A warm session which fails is retried once on a new session, as the
+ * server child may have timed out in the meantime.
+ * sockfd - socket the worker talks to the servers on
+ * job - job to run
+ * Returns 0 on success and -1 on failure.
+ */
+static int runJob(int sockfd, struct job *job)
+{
+	struct session *s;
+	FILE *fp;
+	int warm, rc;
+
+	if ( (fp = fopen(job->localName, "r")) == NULL)
+		return(-1);
+
+	s = findSession(sockfd, &job->servaddr);
+	warm = s->active && time(NULL) - s->lastused < SESSION_IDLE_TIMEOUT - SESSION_GUARD;
+
+	if (warm)
+		rc = transferFile(fp, job->remoteName, sockfd,
+				(struct sockaddr *) &s->sessaddr, sizeof(s->sessaddr),
+				(struct sockaddr *) &s->sessaddr, sizeof(s->sessaddr));
+	if (!warm || (rc < 0 && fseek(fp, 0L, SEEK_SET) == 0))
+		rc = transferFile(fp, job->remoteName, sockfd,
+				(struct sockaddr *) &s->servaddr, sizeof(s->servaddr),
+				(struct sockaddr *) &s->sessaddr, sizeof(s->sessaddr));
+
+	s->active = (rc == 0);
+	s->lastused = time(NULL);
+	fclose(fp);
+	return(rc);
+}
+
+/*workerLoop -
+ * Worker process main loop. Runs the jobs sent by the daemon one at a time
+ * and exits, closing its sessions, when the daemon goes away.
+ * fd - socket to the daemon
+ */
+static void workerLoop(int fd)
+{
+	struct job          job;
+	struct jobresult    res;
+	struct session      *s;
+	int                 sockfd;
+
+	sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+	if (zeroCopy)
+		enableZeroCopy(sockfd);
+
+	while (Read(fd, &job, sizeof(job)) == sizeof(job))
+	{
+		res.id = job.id;
+		res.status = runJob(sockfd, &job);
+		Write(fd, &res, sizeof(res));
+	}
+
+	for (s = sessions; s < sessions + MAXSESSIONS; s++)
+		if (s->active)
+			closeSession(sockfd, (struct sockaddr *) &s->sessaddr, sizeof(s->sessaddr));
+	close(sockfd);
+	exit(0);
+}
+
+/*parseAddr -
+ * Converts "<ip>:<port>" into a socket address.
+ * Returns 0 on success and -1 if the string is not of that form.
+ */
+static int parseAddr(const char *str, struct sockaddr_in *addr)
+{
+	char    ip[INET_ADDRSTRLEN];
+	const char *colon = strchr(str, ':');
+	char    *end;
+	long    port;
+
+	if (colon == NULL || colon - str >= sizeof(ip))
+		return(-1);
+	memcpy(ip, str, colon - str);
+	ip[colon - str] = 0;
+
+	//port must be a number a datagram can be sent to
+	errno = 0;
+	port = strtol(colon + 1, &end, 10);
+	if (errno != 0 || end == colon + 1 || *end != 0 || port < 1 || port > 65535)
+		return(-1);
+
+	bzero(addr, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	if (inet_pton(AF_INET, ip, &addr->sin_addr) != 1)
+		return(-1);
+	return(0);
+}
+
+/*replyJob -
+ * Sends the result of a job to its submitter and closes the submitter
+ * connection once all its jobs are answered.
+ */
+static void replyJob(int c, const char *status, const char *remoteName)
+{
+	char    reply[MAXLINE + 8];
+	int     len;
+
+	len = snprintf(reply, sizeof(reply), "%s %s", status, remoteName);
+	//the submitter may have gone away, its result is simply lost
+	send(conns[c].fd, reply, len, MSG_NOSIGNAL);
+
+	if (--conns[c].pending == 0 && conns[c].eof)
+	{
+		close(conns[c].fd);
+		conns[c].fd = -1;
+	}
+}
+
+/*queueJob -
+ * Parses a job message from a submitter and puts it in the job table.
+ * c - submitter connection
+ * msg - null terminated job message
+ */
+static void queueJob(int c, char *msg)
+{
+	static unsigned long order;
+	char    *prio, *addr, *local, *remote, *save;
+	int     j;
+
+	prio = strtok_r(msg, "\t", &save);
+	addr = strtok_r(NULL, "\t", &save);
+	local = strtok_r(NULL, "\t", &save);
+	remote = strtok_r(NULL, "\t", &save);
+
+	for (j = 0; j < MAXJOBS && jobs[j].used; j++)
+		;
+
+	conns[c].pending++;
+	if (remote == NULL || j == MAXJOBS || strlen(local) >= PATH_MAX ||
+			strlen(remote) >= MAXLINE ||
+			parseAddr(addr, &jobs[j].job.servaddr) < 0)
+	{
+		replyJob(c, "FAIL", remote != NULL ? remote : "");
+		return;
+	}
+
+	jobs[j].used = 1;
+	jobs[j].running = 0;
+	jobs[j].prio = atoi(prio);
+	jobs[j].order = order++;
+	jobs[j].conn = c;
+	jobs[j].job.id = j;
+	strcpy(jobs[j].job.localName, local);
+	strcpy(jobs[j].job.remoteName, remote);
+}
+
+/*startWorker -
+ * Forks a worker process. The worker keeps none of the daemon's sockets
+ * but its own end of the socket pair.
+ * w - worker slot
+ * listenfd - daemon listening socket, -1 if not open yet
+ */
+static void startWorker(int w, int listenfd)
+{
+	int     sv[2], i;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		bail("socketpair error");
+	if ( (workers[w].pid = fork()) < 0)
+		bail("fork error");
+	if (workers[w].pid == 0)
+	{
+		close(sv[0]);
+		if (listenfd >= 0)
+			close(listenfd);
+		for (i = 0; i < MAXWORKERS; i++)
+			if (i != w && workers[i].pid > 0)
+				close(workers[i].fd);
+		for (i = 0; i < MAXCONNS; i++)
+			if (conns[i].fd >= 0)
+				close(conns[i].fd);
+		workerLoop(sv[1]);
+	}
+	close(sv[1]);
+	workers[w].fd = sv[0];
+	workers[w].job = -1;
+	bzero(&workers[w].lastserv, sizeof(workers[w].lastserv));
+}
+
+/*restartWorker -
+ * Replaces a worker process which died, for instance on an error it
+ * bailed out on in the middle of a transfer. Its running job fails.
+ * w - worker slot
+ * listenfd - daemon listening socket
+ */
+static void restartWorker(int w, int listenfd)
+{
+	int     j = workers[w].job;
+
+	close(workers[w].fd);
+	kill(workers[w].pid, SIGKILL); //in case it is alive but not talking to us
+	waitpid(workers[w].pid, NULL, 0);
+	if (j >= 0)
+	{
+		jobs[j].used = 0;
+		replyJob(jobs[j].conn, "FAIL", jobs[j].job.remoteName);
+	}
+	startWorker(w, listenfd);
+}
+
+/*dispatchJobs -
+ * Hands queued jobs to idle workers, highest priority first.
+ * nworkers - number of worker processes
+ * listenfd - daemon listening socket, to restart a worker which died
+ */
+static void dispatchJobs(int nworkers, int listenfd)
+{
+	int     j, w, next, idle;
+
+	for ( ; ; )
+	{
+		//pick the next job
+		next = -1;
+		for (j = 0; j < MAXJOBS; j++)
+		{
+			if (!jobs[j].used || jobs[j].running)
+				continue;
+			if (next < 0 || jobs[j].prio > jobs[next].prio ||
+					(jobs[j].prio == jobs[next].prio && jobs[j].order < jobs[next].order))
+				next = j;
+		}
+		if (next < 0)
+			return;
+
+		//prefer an idle worker which already has a session to the server
+		idle = -1;
+		for (w = 0; w < nworkers; w++)
+		{
+			if (workers[w].job >= 0)
+				continue;
+			if (idle < 0)
+				idle = w;
+			if (workers[w].lastserv.sin_addr.s_addr == jobs[next].job.servaddr.sin_addr.s_addr &&
+					workers[w].lastserv.sin_port == jobs[next].job.servaddr.sin_port)
+			{
+				idle = w;
+				break;
+			}
+		}
+		if (idle < 0)
+			return;
+
+		jobs[next].running = 1;
+		workers[idle].job = next;
+		workers[idle].lastserv = jobs[next].job.servaddr;
+		if (send(workers[idle].fd, &jobs[next].job, sizeof(jobs[next].job), MSG_NOSIGNAL) !=
+				sizeof(jobs[next].job))
+			restartWorker(idle, listenfd);
+	}
+}
+
+/*runDaemon -
+ * Client daemon main loop. Accepts jobs on the unix socket, queues them
+ * and runs them on the worker processes.
+ * sockpath - unix socket path to listen on
+ * nworkers - number of worker processes
+ */
+static void runDaemon(const char *sockpath, int nworkers)
+{
+	struct sockaddr_un  unaddr;
+	struct pollfd       pfd[1 + MAXCONNS + MAXWORKERS];
+	int                 who[1 + MAXCONNS + MAXWORKERS]; //conn index, or MAXCONNS + worker index
+	char                msg[PATH_MAX + MAXLINE + 64];
+	struct jobresult    res;
+	int                 listenfd, nfds, i, c, w;
+	ssize_t             n;
+
+	for (c = 0; c < MAXCONNS; c++)
+		conns[c].fd = -1;
+
+	//start the workers first so they don't inherit the listening socket
+	for (w = 0; w < nworkers; w++)
+		startWorker(w, -1);
+
+	listenfd = Socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	bzero(&unaddr, sizeof(unaddr));
+	unaddr.sun_family = AF_UNIX;
+	strncpy(unaddr.sun_path, sockpath, sizeof(unaddr.sun_path) - 1);
+	unlink(sockpath); //left over from a previous run
+	Bind(listenfd, (struct sockaddr *) &unaddr, sizeof(unaddr));
+	if (listen(listenfd, SOMAXCONN) < 0)
+		bail("listen error");
+
+	printf("Client daemon listening on -> %s with %d workers\n", sockpath, nworkers);
+	fflush(stdout);
+
+	for ( ; ; )
+	{
+		//listening socket, only while there is room for another submitter
+		nfds = 0;
+		for (c = 0; c < MAXCONNS && conns[c].fd >= 0; c++)
+			;
+		if (c < MAXCONNS)
+		{
+			pfd[nfds].fd = listenfd;
+			pfd[nfds].events = POLLIN;
+			who[nfds++] = -1;
+		}
+		for (c = 0; c < MAXCONNS; c++)
+		{
+			if (conns[c].fd < 0 || conns[c].eof)
+				continue;
+			pfd[nfds].fd = conns[c].fd;
+			pfd[nfds].events = POLLIN;
+			who[nfds++] = c;
+		}
+		for (w = 0; w < nworkers; w++)
+		{
+			if (workers[w].job < 0)
+				continue;
+			pfd[nfds].fd = workers[w].fd;
+			pfd[nfds].events = POLLIN;
+			who[nfds++] = MAXCONNS + w;
+		}
+
+		if (poll(pfd, nfds, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			bail("poll error");
+		}
+
+		for (i = 0; i < nfds; i++)
+		{
+			if (pfd[i].revents == 0)
+				continue;
+
+			if (who[i] < 0)
+			{
+				//new submitter
+				for (c = 0; conns[c].fd >= 0; c++)
+					;
+				if ( (conns[c].fd = accept(listenfd, NULL, NULL)) < 0)
+					continue;
+				conns[c].pending = 0;
+				conns[c].eof = 0;
+			}
+			else if (who[i] < MAXCONNS)
+			{
+				//job from a submitter, an empty message means it has sent all its jobs
+				c = who[i];
+				n = recv(conns[c].fd, msg, sizeof(msg) - 1, 0);
+				if (n <= 0)
+				{
+					conns[c].eof = 1;
+					if (conns[c].pending == 0)
+					{
+						close(conns[c].fd);
+						conns[c].fd = -1;
+					}
+					continue;
+				}
+				msg[n] = 0;
+				queueJob(c, msg);
+			}
+			else
+			{
+				//job finished on a worker. A worker which died fails its job and
+				//is replaced, the daemon and the other jobs carry on
+				w = who[i] - MAXCONNS;
+				if (recv(workers[w].fd, &res, sizeof(res), 0) != sizeof(res) ||
+						res.id != workers[w].job)
+				{
+					restartWorker(w, listenfd);
+					continue;
+				}
+				workers[w].job = -1;
+				jobs[res.id].used = 0;
+				replyJob(jobs[res.id].conn, res.status == 0 ? "OK" : "FAIL",
+						jobs[res.id].job.remoteName);
+			}
+		}
+
+		dispatchJobs(nworkers, listenfd);
+	}
+}
+
+/*submitJobs -
+ * Queues files on the client daemon and waits for their results.
+ * sockpath - unix socket path of the daemon
+ * prio - priority of the jobs
+ * server - server address as "<ip>:<port>"
+ * files - files to transfer
+ * nfiles - number of files
+ * Returns the number of files which failed.
+ */
+static int submitJobs(const char *sockpath, int prio, const char *server,
+		char **files, int nfiles)
+{
+	struct sockaddr_un  unaddr;
+	char                msg[PATH_MAX + MAXLINE + 64];
+	char                localName[PATH_MAX];
+	int                 fd, i, len, queued = 0, failed = 0;
+	ssize_t             n;
+
+	fd = Socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	bzero(&unaddr, sizeof(unaddr));
+	unaddr.sun_family = AF_UNIX;
+	strncpy(unaddr.sun_path, sockpath, sizeof(unaddr.sun_path) - 1);
+	Connect(fd, (struct sockaddr *) &unaddr, sizeof(unaddr));
+
+	for (i = 0; i < nfiles; i++)
+	{
+		//the daemon runs in its own directory, send it the full path
+		if (realpath(files[i], localName) == NULL)
+		{
+			printf("FAIL %s\n", files[i]);
+			failed++;
+			continue;
+		}
+		len = snprintf(msg, sizeof(msg), "%d\t%s\t%s\t%s", prio, server, localName, files[i]);
+		Write(fd, msg, len);
+		queued++;
+	}
+	//no more jobs
+	shutdown(fd, SHUT_WR);
+
+	for (i = 0; i < queued; i++)
+	{
+		if ( (n = Read(fd, msg, sizeof(msg) - 1)) == 0)
+			bail("client daemon closed the connection");
+		msg[n] = 0;
+		printf("%s\n", msg);
+		if (strncmp(msg, "OK ", 3) != 0)
+			failed++;
+	}
+
+	close(fd);
+	return(failed);
+}
+
+/*printStats -
+ * Prints the throughput of a transfer and the cpu time it took per byte,
+ * user and system time of all threads, to compare send modes.
+ * bytes - size of the file
+ * ms - wall clock time of the transfer
+ */
+static void printStats(off_t bytes, long long ms)
+{
+	struct rusage   ru;
+	double          cpu;
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e9 +
+			(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e3;
+	printf("%lld bytes in %.3f s, %.1f MB/s, %.2f cpu ns/byte (zero copy %s)\n",
+			(long long) bytes, ms / 1e3, ms > 0 ? bytes / 1e3 / ms : 0.0,
+			bytes > 0 ? cpu / bytes : 0.0,
+			!zeroCopy ? "off" : zc.enabled ? "on" : "fell back to copying");
+}
+
+//prints the command line usage and exits
+static void usage(void)
+{
+	printf("\nusage -> [-z] [-v] <ip>:<port> <data-file>"
+			"\n         -d [-z] [-j <workers>] [-s <socket>]                     run client daemon"
+			"\n         -q [-p <priority>] [-s <socket>] <ip>:<port> <data-file>...  queue files on client daemon"
+			"\n   -z sends file data with zero copy, -v prints throughput and cpu cost\n");
+	exit(1);
 }
 
 /*
  * main Client function
  * This function is responsible to receiving user arguments server address, filename
  * and starts the file transfer process.
+ * With -d it runs the client daemon and with -q it hands the files to the daemon instead.
  */
 int main(int argc, char **argv)
 {
@@ -193,54 +1324,80 @@ int main(int argc, char **argv)
 	struct sockaddr_in      servaddr, recvaddr;
 	//File pointer which will hold the handle to the file being transferred
 	FILE *fp = NULL;
+	const char *sockpath = DAEMON_SOCK; //client daemon socket
+	int daemonMode = 0, queueMode = 0, verbose = 0;
+	int nworkers = 4, prio = 0;
+	int opt;
+	long long start; //transfer start time for -v
+	struct stat st;
 
-	//Check to see if we received the required arguments from user
-	if (argc != 3)
+	while ( (opt = getopt(argc, argv, "dqzvj:p:s:")) != -1)
 	{
-		printf("\nusage -> <ip>:<port> <data-file>");
-		exit(1);
+		switch (opt)
+		{
+			case 'd': daemonMode = 1; break;
+			case 'q': queueMode = 1; break;
+			case 'z': zeroCopy = 1; break;
+			case 'v': verbose = 1; break;
+			case 'j': nworkers = atoi(optarg); break;
+			case 'p': prio = atoi(optarg); break;
+			case 's': sockpath = optarg; break;
+			default: usage();
+		}
 	}
 
+	if (daemonMode)
+	{
+		if (optind != argc || nworkers < 1 || nworkers > MAXWORKERS)
+			usage();
+		runDaemon(sockpath, nworkers);
+	}
+
+	if (queueMode)
+	{
+		if (argc - optind < 2)
+			usage();
+		exit(submitJobs(sockpath, prio, argv[optind], argv + optind + 1,
+				argc - optind - 1) == 0 ? 0 : 1);
+	}
+
+	//Check to see if we received the required arguments from user
+	if (argc - optind != 2)
+		usage();
+
 	/* Addr on cmdline: */
-	const char delimiters[] = ":";
-	char *srvr_addr_port = strdup(argv[1]);
-	char *srvr_addr = strtok(srvr_addr_port,delimiters);
-	char *srvr_port = strtok(NULL,delimiters); //server address
-	int srvrport = atoi(srvr_port); // server port
-	char *fileName = argv[2];
+	char *fileName = argv[optind + 1];
 
 #ifdef DEBUGTRACE
 	//print data which the user entered
-	printf("Address::%s\n",srvr_addr);
-	printf("Port::%d\n",srvrport);
+	printf("Address::%s\n",argv[optind]);
 	printf("Filename::%s\n",fileName);
 #endif
 
 	//populate server address structure with ip address and port
-	bzero(&servaddr, sizeof(servaddr));
-	servaddr.sin_family = AF_INET;
-	servaddr.sin_port = htons(srvrport);
-	Inet_pton(AF_INET, srvr_addr, &servaddr.sin_addr);
+	if (parseAddr(argv[optind], &servaddr) < 0)
+		usage();
 
 	//create a socket to send requests to the server
 	sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+	if (zeroCopy)
+		enableZeroCopy(sockfd);
 
 	//Open file to be transferred to the server
 	fp = Fopen(fileName, "r");
+	start = nowMs();
 
-	//send file transfer request to the server with the filename
-	sendFileOperationReq(WRITEREQ, fileName,sockfd,
+	//send the file, the server answers from the address of a new session
+	if (transferFile(fp, fileName, sockfd,
 			(struct sockaddr *) &servaddr, sizeof(servaddr),
-			(struct sockaddr *) &recvaddr, sizeof(recvaddr));
+			(struct sockaddr *) &recvaddr, sizeof(recvaddr)) < 0)
+		bail("file transfer error");
 
-	//Use the the address received in the previous sendFileOperationReq to
-	//send following packets to the server
-	//Send file data to the Server
-	readAndSendFileData(fp, sockfd, (struct sockaddr *) &recvaddr, sizeof(recvaddr));
+	if (verbose && fstat(fileno(fp), &st) == 0)
+		printStats(st.st_size, nowMs() - start);
 
-	//send file end request to the server
-	sendFileOperationReq(END, fileName,sockfd, (struct sockaddr *) &recvaddr, sizeof(recvaddr),
-			NULL, 0);
+	//no more files on this session
+	closeSession(sockfd, (struct sockaddr *) &recvaddr, sizeof(recvaddr));
 
 	//close the file
 	Fclose(fp);
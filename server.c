@@ -5,28 +5,543 @@
  * 2. After receiving a request spawns a server child process to handle the data.
  * 3. Server child process creates a new socket and sends a response from a new port
  * 4. Server child process then receives any data from the client on this new socket
- * 	  and writes to the file
- * 5. Server child process receives a End of file request from client and then exits.
- * 6. Server Parent process continues to listen for more incoming client requests
+ * 	  and writes to a temporary file next to the destination
+ * 5. Server child process receives a End of file request from client, makes the file
+ *    durable as the durability policy asks and renames it to the destination.
+ *    The session stays open so the client can send further write requests on the same
+ *    port without another handshake with the parent.
+ * 6. Server child process exits when the client closes the session or after
+ *    SESSION_IDLE_TIMEOUT seconds without any packet.
+ * 7. Server Parent process continues to listen for more incoming client requests
  * Created by - Ankit Garg
  */
 
 
+#define _GNU_SOURCE //fallocate, syncfs
 #include "utilities.h"
+#include <pthread.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #define NEW_PORT    9900 //server uses this constant value + number of clients to generate a new port
+#define WRITE_BUFFER   (64 * 1024) //stdio buffer of the file being received
+#define MAXGROUPS      8           //filesystems with a group commit running at once
+#define MAXUPLOADS     64          //uploads a group commit leader keeps track of
+#define LEADER_CHECK   1000        //ms between checks that a group commit leader is alive
+#define MAXPREALLOC    (1LL << 30) //most a write request can preallocate, larger files grow as written
 //number of clients.
 static int numClients = 0;
 
-//header for DG
-struct hdr {
-  uint32_t      opcode;         //operation code
-  uint32_t      seq;            //sequence #
-  uint32_t      ts;             //timestamp when sent
+//Flow control -
+//Data packets are acknowledged cumulatively. Every ack carries the number of
+//packets the client may send beyond the acked one, which is the free space in
+//the queue below. Packets wait in the queue until they are in order and written
+//to the file, so the window closes when disk writes fall behind. The socket
+//receive buffer is sized to hold a full window, so nothing the client is allowed
+//to send is dropped by the kernel.
+#define RCVBUF_PKT_COST  (MAXLINE + sizeof(struct hdr) + 4096) //receive buffer charged per datagram, including kernel overhead.
+                                                                 //A datagram sent with MSG_ZEROCOPY holds a whole page
+
+//reorder and write queue, indexed by sequence number
+static struct slot {
+	int         full;           //packet received and not written yet
+	size_t      len;            //length of data
+	char        data[MAXLINE];  //file data
+} queue[RECV_WINDOW];
+
+static uint32_t ackseq;    //highest sequence number received in order
+static uint32_t writeseq;  //next sequence number to write to the file
+static uint32_t wincap;    //queue slots which fit in the socket receive buffer
+
+/*sizeRecvBuffer -
+ *Grows the socket receive buffer to hold a full window of datagrams and
+ *returns the number of queue slots it can actually hold.
+ *sockfd - session socket
+ */
+static uint32_t sizeRecvBuffer(int sockfd)
+{
+	int         want = RECV_WINDOW * RCVBUF_PKT_COST, got;
+	socklen_t   len = sizeof(got);
+
+	//the kernel caps SO_RCVBUF at net.core.rmem_max, SO_RCVBUFFORCE ignores
+	//the cap but needs CAP_NET_ADMIN
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &want, sizeof(want)) < 0 &&
+			setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &want, sizeof(want)) < 0)
+		bail("setsockopt SO_RCVBUF error");
+	if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &got, &len) < 0)
+		bail("getsockopt SO_RCVBUF error");
+
+	//advertise no more than the buffer can hold
+	if (got / RCVBUF_PKT_COST < RECV_WINDOW)
+		return(got / RCVBUF_PKT_COST > 0 ? got / RCVBUF_PKT_COST : 1);
+	return(RECV_WINDOW);
+}
+
+/*window -
+ *Returns the number of packets the client may send beyond ackseq.
+ */
+static uint32_t window(void)
+{
+	return(writeseq + wincap - 1 - ackseq);
+}
+
+/*resetQueue -
+ *Empties the queue and starts numbering after seq.
+ */
+static void resetQueue(uint32_t seq)
+{
+	int i;
+
+	for (i = 0; i < RECV_WINDOW; i++)
+		queue[i].full = 0;
+	ackseq = seq;
+	writeseq = seq + 1;
+}
+
+/*flushQueue -
+ *Writes the packets received in order to the file and frees their slots.
+ *fp - File which needs to be written
+ */
+static void flushQueue(FILE *fp)
+{
+	struct slot *slot;
+
+	for ( ; writeseq <= ackseq; writeseq++)
+	{
+		slot = &queue[writeseq % RECV_WINDOW];
+		Fwrite(slot->data, slot->len, fp);
+		slot->full = 0;
+	}
+}
+
+//Durability -
+//An upload is written to a temporary file in the destination directory and
+//renamed over the destination when it ends, so the destination is never seen
+//half written and concurrent uploads of the same name do not mix. The end
+//request is acked once the durability policy is met:
+// none  - rename only, the data reaches the disk when the kernel writes it back
+// sync  - fdatasync the file, rename, fsync the directory
+// group - like sync, but the sessions waiting on one filesystem share a syncfs.
+//         The first waiter leads. While other sessions are still receiving a
+//         file on the filesystem it waits up to groupInterval ms for them to
+//         join, then syncs the whole filesystem once for all of them.
+enum DURABILITY
+{
+	DURABLE_NONE = 0,
+	DURABLE_SYNC,
+	DURABLE_GROUP
 };
 
+static int      durability = DURABLE_GROUP;
+static long     groupInterval = 10;  //most ms a group commit leader waits for others to join
+static mode_t   fileMode;            //mode of received files, 0666 less the umask
+
+//group commit of one filesystem, shared by all session children
+struct commitgroup {
+	int             used;
+	dev_t           dev;        //filesystem
+	uint64_t        started;    //last sync started
+	uint64_t        done;       //last sync finished
+	uint64_t        failures;   //syncs which failed
+	int             syncing;    //a leader is gathering or syncing
+	int             waiters;    //sessions in groupCommit, the group is released when none are left
+	pid_t           leader;     //session child leading
+	pthread_cond_t  committed;  //signalled when a sync finishes
+	pthread_cond_t  joined;     //signalled when a session joins
+};
+
+//file being received by a session child
+struct upload {
+	pid_t   pid;    //session child, 0 if the slot is free
+	dev_t   dev;    //filesystem it is written to
+};
+
+static struct commitshm {
+	pthread_mutex_t     lock;
+	struct commitgroup  groups[MAXGROUPS];
+	struct upload       uploads[MAXUPLOADS];
+} *commit;
+
+//upload in progress in this session child
+static char tmpName[PATH_MAX];    //file being written
+static char finalName[PATH_MAX];  //destination it is renamed to
+
+/*initGroupCommit -
+ *Sets up the group commit state in memory shared with the session children.
+ *Called by the parent before any child is forked.
+ */
+static void initGroupCommit(void)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t  cattr;
+	int                 i;
+
+	commit = mmap(NULL, sizeof(*commit), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (commit == MAP_FAILED)
+		bail("mmap error");
+
+	//robust, so a session child dying with the lock held does not block the others
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&commit->lock, &mattr);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	for (i = 0; i < MAXGROUPS; i++) {
+		pthread_cond_init(&commit->groups[i].committed, &cattr);
+		pthread_cond_init(&commit->groups[i].joined, &cattr);
+	}
+}
+
+/*lockCommit -
+ *Takes the commit lock, recovering it if its owner died.
+ */
+static void lockCommit(void)
+{
+	if (pthread_mutex_lock(&commit->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&commit->lock);
+}
+
+/*waitCommit -
+ *Waits on a group commit condition with the commit lock held.
+ *cond     - condition to wait on
+ *deadline - CLOCK_MONOTONIC time to give up at
+ *Returns 0 when signalled, ETIMEDOUT or another error.
+ */
+static int waitCommit(pthread_cond_t *cond, struct timespec *deadline)
+{
+	int rc;
+
+	if ( (rc = pthread_cond_timedwait(cond, &commit->lock, deadline)) == EOWNERDEAD) {
+		pthread_mutex_consistent(&commit->lock);
+		rc = 0;
+	}
+	return(rc);
+}
+
+/*deadlineIn -
+ *Sets a CLOCK_MONOTONIC deadline.
+ *ts - deadline to set
+ *ms - milliseconds from now
+ */
+static void deadlineIn(struct timespec *ts, long ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += ms % 1000 * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*trackUpload -
+ *Records that this session is receiving a file, so a group commit leader on
+ *the same filesystem waits for it. If the table is full the upload is not
+ *tracked and leaders just do not wait for it.
+ *fd - file being written
+ */
+static void trackUpload(int fd)
+{
+	struct upload   *u, *slot = NULL;
+	struct stat     st;
+
+	if (commit == NULL || fstat(fd, &st) < 0)
+		return;
+
+	lockCommit();
+	for (u = commit->uploads; u < commit->uploads + MAXUPLOADS; u++)
+		if (u->pid == 0) {
+			slot = u;
+			break;
+		}
+	if (slot != NULL) {
+		slot->pid = getpid();
+		slot->dev = st.st_dev;
+	}
+	pthread_mutex_unlock(&commit->lock);
+}
+
+/*untrackUpload -
+ *Forgets the file this session was receiving. Called with the commit lock held.
+ */
+static void untrackUpload(void)
+{
+	struct upload   *u;
+	pid_t           pid = getpid();
+
+	for (u = commit->uploads; u < commit->uploads + MAXUPLOADS; u++)
+		if (u->pid == pid)
+			u->pid = 0;
+}
+
+/*othersWriting -
+ *Tells if sessions other than this one are still receiving a file on a
+ *filesystem. Sessions which died are forgotten. Called with the commit lock held.
+ *dev - filesystem
+ */
+static int othersWriting(dev_t dev)
+{
+	struct upload   *u;
+	pid_t           pid = getpid();
+
+	for (u = commit->uploads; u < commit->uploads + MAXUPLOADS; u++) {
+		if (u->pid == 0 || u->pid == pid || u->dev != dev)
+			continue;
+		if (kill(u->pid, 0) < 0 && errno == ESRCH) {
+			u->pid = 0;
+			continue;
+		}
+		return(1);
+	}
+	return(0);
+}
+
+/*groupCommit -
+ *Waits until everything written to fd before the call is on disk, sharing
+ *one syncfs with the other sessions waiting on the same filesystem.
+ *fd     - file written by this session
+ *gather - non zero to let sessions still receiving a file join before syncing
+ *Returns 0 on success, -1 on failure and 1 when every group is taken by
+ *other filesystems, in which case the caller has to sync alone.
+ */
+static int groupCommit(int fd, int gather)
+{
+	struct commitgroup  *g, *spare = NULL;
+	struct stat         st;
+	struct timespec     deadline;
+	uint64_t            need, epoch, failures;
+	int                 rc;
+
+	if (fstat(fd, &st) < 0)
+		return(-1);
+
+	lockCommit();
+	//this session is done writing, leaders need not wait for it any more
+	untrackUpload();
+	for (g = commit->groups; g < commit->groups + MAXGROUPS; g++) {
+		if (g->used && g->dev == st.st_dev)
+			break;
+		if (!g->used && spare == NULL)
+			spare = g;
+	}
+	if (g == commit->groups + MAXGROUPS) {
+		if ( (g = spare) == NULL) {
+			pthread_mutex_unlock(&commit->lock);
+			return(1);
+		}
+		g->used = 1;
+		g->dev = st.st_dev;
+	}
+	g->waiters++;
+
+	//a sync which starts from now on covers our writes. Syncs may finish
+	//after we are covered, a failure of any sync finishing while we wait
+	//fails the commit. At worst the client resends a file which was stored
+	need = g->started + 1;
+	failures = g->failures;
+	pthread_cond_broadcast(&g->joined);
+	while (g->done < need) {
+		if (g->syncing) {
+			deadlineIn(&deadline, LEADER_CHECK);
+			if (waitCommit(&g->committed, &deadline) != ETIMEDOUT ||
+					kill(g->leader, 0) == 0 || errno != ESRCH)
+				continue;
+
+			//the leader died. A sync it started may not have completed,
+			//the next leader redoes it under the same number
+			g->started = g->done;
+			g->syncing = 0;
+			g->waiters--;
+			pthread_cond_broadcast(&g->committed);
+			continue;
+		}
+
+		//lead the next sync. Sessions still receiving a file are likely to
+		//want one soon, give them a while to join. Alone there is no wait
+		g->syncing = 1;
+		g->leader = getpid();
+		if (gather) {
+			deadlineIn(&deadline, groupInterval);
+			while (othersWriting(g->dev) && waitCommit(&g->joined, &deadline) == 0)
+				;
+		}
+		epoch = ++g->started;
+		pthread_mutex_unlock(&commit->lock);
+
+#ifdef DEBUGTRACE
+		printf("Group commit %llu\n", (unsigned long long) epoch);
+#endif
+		rc = syncfs(fd);
+
+		lockCommit();
+		if (rc < 0)
+			g->failures++;
+		g->done = epoch;
+		g->syncing = 0;
+		pthread_cond_broadcast(&g->committed);
+	}
+	rc = (g->failures != failures) ? -1 : 0;
+	if (--g->waiters == 0)
+		g->used = 0;
+	pthread_mutex_unlock(&commit->lock);
+	return(rc);
+}
+
+/*openUpload -
+ *Creates the temporary file an upload is written to. The write request
+ *carries the destination name and, after its null character, the file size
+ *which is preallocated.
+ *req - write request data, null terminated
+ *len - length of the write request data
+ *Returns the file to write.
+ */
+static FILE *openUpload(char *req, size_t len)
+{
+	char        dir[PATH_MAX], base[PATH_MAX];
+	long long   size = 0;
+	int         fd;
+	FILE        *fp;
+
+	if (strlen(req) + 1 < len)
+		size = strtoll(req + strlen(req) + 1, NULL, 10);
+
+	strncpy(dir, req, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = 0;
+	strncpy(base, req, sizeof(base) - 1);
+	base[sizeof(base) - 1] = 0;
+	strncpy(finalName, req, sizeof(finalName) - 1);
+	snprintf(tmpName, sizeof(tmpName), "%s/.%s.XXXXXX", dirname(dir), basename(base));
+
+	if ( (fd = mkstemp(tmpName)) < 0)
+		bail("mkstemp error");
+	trackUpload(fd);
+	if (fchmod(fd, fileMode) < 0)
+		bail("fchmod error");
+	//reserve the blocks up front, the size grows as data is written.
+	//Not every filesystem supports it, the data is written either way.
+	//The size comes from the client, so it is capped and whatever the
+	//upload does not use is trimmed when it ends
+	if (size > MAXPREALLOC)
+		size = MAXPREALLOC;
+	if (size > 0)
+		fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+
+	if ( (fp = fdopen(fd, "w")) == NULL)
+		bail("fdopen error");
+	setvbuf(fp, NULL, _IOFBF, WRITE_BUFFER);
+	return(fp);
+}
+
+/*abortUpload -
+ *Drops an upload the client abandoned.
+ *fp - File being written
+ */
+static void abortUpload(FILE *fp)
+{
+	if (commit != NULL) {
+		lockCommit();
+		untrackUpload();
+		pthread_mutex_unlock(&commit->lock);
+	}
+	fclose(fp);
+	unlink(tmpName);
+}
+
+/*commitUpload -
+ *Makes an upload durable as the policy asks and renames it to its destination.
+ *fp - File being written, closed on return
+ */
+static void commitUpload(FILE *fp)
+{
+	char    dir[PATH_MAX];
+	int     dirfd, rc = 0, policy = durability;
+
+	if (fflush(fp) != 0)
+		bail("fflush error");
+	//release blocks preallocated past the end of what was received
+	if (ftruncate(fileno(fp), ftello(fp)) < 0)
+	{
+		abortUpload(fp);
+		bail("ftruncate error");
+	}
+
+	//the data has to be on disk before the rename, or a crash could leave
+	//the destination name pointing at missing data. Without a free commit
+	//group the upload is synced on its own as with the sync policy
+	if (policy == DURABLE_GROUP && (rc = groupCommit(fileno(fp), 1)) != 0)
+		policy = DURABLE_SYNC;
+	if (rc < 0 || (policy == DURABLE_SYNC && fdatasync(fileno(fp)) < 0))
+	{
+		abortUpload(fp);
+		bail("sync error");
+	}
+
+	if (rename(tmpName, finalName) < 0)
+	{
+		abortUpload(fp);
+		bail("rename error");
+	}
+
+	//and then the rename itself. The group commit joins whichever sync
+	//other sessions start next, without gathering
+	if (policy == DURABLE_GROUP && (rc = groupCommit(fileno(fp), 0)) != 0)
+	{
+		if (rc < 0)
+			bail("sync error");
+		policy = DURABLE_SYNC;
+	}
+	if (policy == DURABLE_SYNC)
+	{
+		strncpy(dir, finalName, sizeof(dir) - 1);
+		dir[sizeof(dir) - 1] = 0;
+		if ( (dirfd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) < 0 || fsync(dirfd) < 0)
+			bail("directory fsync error");
+		close(dirfd);
+	}
+
+	Fclose(fp);
+}
+
+/*sendAck -
+ *Acknowledges all packets up to ackseq and advertises the free window.
+ *sockfd - Socket on which the ack is sent
+ *pcliaddr - Client socket address
+ *clilen - Client socket address length.
+ *ts - time stamp to echo
+ */
+static void sendAck(int sockfd, struct sockaddr *pcliaddr, socklen_t clilen, uint32_t ts)
+{
+	struct hdr      sendhdr;
+	struct iovec    iovsend[1];
+
+	memset(&msgsend,0,sizeof(msgsend));
+
+	//populate msg send structures to send ack
+	msgsend.msg_name = pcliaddr;
+	msgsend.msg_namelen = clilen;
+	msgsend.msg_iov = iovsend;
+	msgsend.msg_iovlen = 1;
+	sendhdr.opcode = ACK;
+	sendhdr.seq = ackseq;    //everything up to here has been received
+	sendhdr.ts = ts;         //echo time stamp received
+	sendhdr.win = window();
+	iovsend[0].iov_base = &sendhdr;
+	iovsend[0].iov_len = sizeof(struct hdr);
+
+#ifdef DEBUGTRACE
+	printf("Sending ack seq=%u win=%u\n", sendhdr.seq, sendhdr.win);
+#endif
+	Sendmsg(sockfd, &msgsend, 0);
+}
+
 /*
  *This function is called by the server child process.
- *It receives the file data and writes it into the file pointed by fp
+ *It receives the file data and writes it into the file pointed by fp.
+ *Further write requests on the same session open the next file.
  *fp - File which needs to be written
  *sockfd - Socket which the server is expecting client to send file data
  *pcliaddr - Client socket address
@@ -35,12 +550,21 @@ struct hdr {
 void recvAndProcessClientData(FILE *fp, int sockfd,struct sockaddr *pcliaddr, socklen_t clilen)
 {
 	ssize_t                 n;                      //number of bytes received
-	struct hdr              sendhdr,recvhdr;        //send and receive headers
-	struct iovec            iovsend[2], iovrecv[2]; //send and receive iov structures
+	struct hdr              recvhdr;                //receive header
+	struct iovec            iovrecv[2];             //receive iov structures
 	char                    recvline[MAXLINE + 1];  //Buffer to hold file data received
-	time_t curr_ts;
-
-	//Keep looping until end of file indication is received from sending client
+	struct timeval          idle;                   //session idle timeout
+	struct slot             *slot;
+	uint32_t                backlog;                //packets waiting to be written
+	uint32_t                lastwin = wincap;       //window advertised in the last ack
+
+	//give up on the session if the client goes quiet
+	idle.tv_sec = SESSION_IDLE_TIMEOUT;
+	idle.tv_usec = 0;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle)) < 0)
+		bail("setsockopt SO_RCVTIMEO error");
+
+	//Keep looping until the client closes the session
 	for ( ; ; ) {
 
 		//populate msg recv structures
@@ -53,8 +577,45 @@ void recvAndProcessClientData(FILE *fp, int sockfd,struct sockaddr *pcliaddr, so
 		iovrecv[1].iov_base = recvline;
 		iovrecv[1].iov_len = MAXLINE;
 
-		n = Recvmsg(sockfd, &msgrecv, 0);
+		//receiving comes before writing. Queued packets are written once the socket
+		//is drained or half the window is waiting for the disk
+		backlog = ackseq + 1 - writeseq;
+		if (backlog > 0)
+		{
+			if (backlog < (wincap + 1) / 2 &&
+					(n = recvmsg(sockfd, &msgrecv, MSG_DONTWAIT)) >= 0)
+				goto received;
+			if (backlog < (wincap + 1) / 2 && errno != EAGAIN && errno != EWOULDBLOCK)
+				bail("recvmsg error");
+
+			flushQueue(fp);
+			//the client stops sending on a zero window, tell it the window opened.
+			//It probes if this update gets lost
+			if (lastwin == 0)
+			{
+				sendAck(sockfd, pcliaddr, clilen, 0);
+				lastwin = window();
+			}
+			continue;
+		}
+
+		if ( (n = recvmsg(sockfd, &msgrecv, 0)) < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				bail("recvmsg error");
+#ifdef DEBUGTRACE
+			printf("Session idle for %d seconds, closing\n", SESSION_IDLE_TIMEOUT);
+#endif
+			//client went away without closing the session
+			if (fp != NULL)
+				abortUpload(fp);
+			return;
+		}
 
+		received:
+		//drop runt datagrams, they don't even hold a header
+		if (n < (ssize_t) sizeof(struct hdr))
+			continue;
 		//terminate the recline buffer with null character
 		recvline[n-sizeof(struct hdr)] = 0;
 
@@ -70,34 +631,64 @@ void recvAndProcessClientData(FILE *fp, int sockfd,struct sockaddr *pcliaddr, so
 		printf("Recieved Opcode:%d \n",recvhdr.opcode);
 #endif
 
+		//a retransmission of a packet already received means our ack was lost.
+		//Only ack it again, processing a control packet twice would truncate the file.
+		//A probe only asks for the current window
+		if (recvhdr.seq <= ackseq || recvhdr.opcode == PROBE)
+			goto sendack;
+
 		switch(recvhdr.opcode)
 		{
 			case WRITEREQ:
 			{
 #ifdef DEBUGTRACE
-				printf("Server received write req when expecting data\n");
+				printf("Server received write req on open session\n");
 #endif
-				//we shouldn't be coming here as the server parent process handles the write req
-				bail("Unexpected opcode: exit");
+				//next file on a reused session. A file still open here was abandoned by the client
+				if (fp != NULL)
+					abortUpload(fp);
+				fp = openUpload(recvline, n - sizeof(struct hdr));
+				resetQueue(recvhdr.seq);
 				break;
 			}
 			case DATA:
 			{
+				//data for a file which is not open any more is stale, and data beyond
+				//the window has no slot, only ack it
+				if (fp == NULL || recvhdr.seq >= writeseq + wincap)
+					break;
 #ifdef DEBUGTRACE
-				printf("Put data in file\n");
-#endif
-				//File data received. Write to file
-				Fputs(recvline,fp);
-				fflush (fp);
-#ifdef DEBUGTRACE
-				printf("Flushed data in file\n");
+				printf("Put data in queue\n");
 #endif
+				//File data received. Queue it until everything before it has arrived
+				slot = &queue[recvhdr.seq % RECV_WINDOW];
+				memcpy(slot->data, recvline, n - sizeof(struct hdr));
+				slot->len = n - sizeof(struct hdr);
+				slot->full = 1;
+				while (ackseq + 1 < writeseq + wincap && queue[(ackseq + 1) % RECV_WINDOW].full)
+					ackseq++;
 				break;
 			}
 			case END:
 			{
-				//end of file data indication
-				Fclose(fp); // close the file
+				//end of file data indication. The client only sends it once all data
+				//is acked, so the whole file is in the queue. The ack waits for the commit
+				if (fp != NULL)
+				{
+					flushQueue(fp);
+					commitUpload(fp); // close the file
+				}
+				fp = NULL;
+				resetQueue(recvhdr.seq);
+				break;
+			}
+			case CLOSE:
+			{
+				//client is done with the session
+				if (fp != NULL)
+					abortUpload(fp);
+				fp = NULL;
+				resetQueue(recvhdr.seq);
 				break;
 			}
 			default:
@@ -112,27 +703,12 @@ void recvAndProcessClientData(FILE *fp, int sockfd,struct sockaddr *pcliaddr, so
 		printf("Out of switch statement\n");
 #endif
 
-		memset(&msgsend,0,sizeof(msgsend));
+		sendack:
+		sendAck(sockfd, pcliaddr, clilen, recvhdr.ts); //send ack
+		lastwin = window();
 
-		//populate msg send structures to send ack
-		msgsend.msg_name = pcliaddr;
-		msgsend.msg_namelen = clilen;
-		msgsend.msg_iov = iovsend;
-		msgsend.msg_iovlen = 1;
-		sendhdr.opcode = ACK;
-		sendhdr.seq = recvhdr.seq; //echo sequence number received
-		sendhdr.ts = recvhdr.ts;   //echo time stamp received
-		iovsend[0].iov_base = &sendhdr;
-		iovsend[0].iov_len = sizeof(struct hdr);
-
-#ifdef DEBUGTRACE
-		printf("Sending Message \n");
-#endif
-		Sendmsg(sockfd, &msgsend, 0); //send ack
-
-		//if end of file indication received from client return to calling function
-		//file transfer is complete
-		if(recvhdr.opcode == END)
+		//if the client closed the session return to calling function
+		if(recvhdr.opcode == CLOSE && recvhdr.seq == ackseq)
 		{
 			return;
 		}
@@ -147,8 +723,8 @@ void recvAndProcessClientData(FILE *fp, int sockfd,struct sockaddr *pcliaddr, so
  */
 void recvClientRequest (int sockfd, struct sockaddr *pcliaddr, socklen_t clilen)
 {
-	struct hdr           sendhdr,recvhdr;         //send and receive headers
-	struct iovec         iovrecv[2],iovsend[2];   //send and receive iov structures
+	struct hdr           recvhdr;                 //receive header
+	struct iovec         iovrecv[2];              //receive iov structures
 	char                 recvline[MAXLINE + 1];   //Buffer to hold filename from the incoming file transfer request
 	ssize_t              n;                       //number of received bytes from client
 	pid_t                childpid;                //holds server child pid
@@ -168,6 +744,9 @@ void recvClientRequest (int sockfd, struct sockaddr *pcliaddr, socklen_t clilen)
 			iovrecv[1].iov_len = MAXLINE;
 
 			n = Recvmsg(sockfd, &msgrecv, 0);
+			//drop runt datagrams, they don't even hold a header
+			if (n < (ssize_t) sizeof(struct hdr))
+				continue;
 			//null terminate the recvline buffer which holds the filename
 			recvline[n-sizeof(struct hdr)] = 0;
 
@@ -203,25 +782,19 @@ void recvClientRequest (int sockfd, struct sockaddr *pcliaddr, socklen_t clilen)
 					bindInterface(childSocket, NEW_PORT+numClients);
 
 					//open file to be written
-					fp = Fopen(recvline, "w");
+					fp = openUpload(recvline, n - sizeof(struct hdr));
 
-					//send acknowledgement
-					msgsend.msg_name = pcliaddr;
-					msgsend.msg_namelen = clilen;
-					msgsend.msg_iov = iovsend;
-					msgsend.msg_iovlen = 1;
-					sendhdr.opcode = ACK;
-					sendhdr.seq = recvhdr.seq;
-					sendhdr.ts = recvhdr.ts;
-					iovsend[0].iov_base = &sendhdr;
-					iovsend[0].iov_len = sizeof(struct hdr);
+					//size the receive buffer for the window before advertising it
+					wincap = sizeRecvBuffer(childSocket);
+					resetQueue(recvhdr.seq);
 
-					Sendmsg(childSocket, &msgsend, 0);
+					//send acknowledgement with the initial window
+					sendAck(childSocket, pcliaddr, clilen, recvhdr.ts);
 
 					//Start receiving file data on new socket
-					recvAndProcessClientData(fp, childSocket, (struct sockaddr *) &pcliaddr, sizeof(pcliaddr));
+					recvAndProcessClientData(fp, childSocket, pcliaddr, clilen);
 
-					//File transfer complete. Close child socket
+					//Session closed. Close child socket
 					close(childSocket);
 
 					//decrease the number of clients currently the server is talking to as file transfer is complete
@@ -247,11 +820,53 @@ void recvClientRequest (int sockfd, struct sockaddr *pcliaddr, socklen_t clilen)
 
 
 //Server main function
-//Doesn't need any command line arguments
+//Optional arguments -
+// -D none|sync|group - durability policy of received files, group by default
+// -i <ms> - time a group commit waits for other sessions to join
 int main(int argc, char **argv)
 {
 	int                     sockfd;
 	struct sockaddr_in      cliaddr;
+	int                     opt;
+
+	while ( (opt = getopt(argc, argv, "D:i:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'D':
+				if (strcmp(optarg, "none") == 0)
+					durability = DURABLE_NONE;
+				else if (strcmp(optarg, "sync") == 0)
+					durability = DURABLE_SYNC;
+				else if (strcmp(optarg, "group") == 0)
+					durability = DURABLE_GROUP;
+				else
+					goto usage;
+				break;
+			case 'i':
+				groupInterval = atol(optarg);
+				break;
+			default:
+				goto usage;
+		}
+	}
+	if (optind != argc || groupInterval < 0)
+	{
+		usage:
+		printf("\nusage -> [-D none|sync|group] [-i <group commit interval ms>]\n");
+		exit(1);
+	}
+
+	//received files get the mode fopen would have given them
+	fileMode = umask(0);
+	umask(fileMode);
+	fileMode = 0666 & ~fileMode;
+
+	if (durability == DURABLE_GROUP)
+		initGroupCommit();
+
+	//session children are never waited for, let the kernel reap them
+	signal(SIGCHLD, SIG_IGN);
 
 	//create a socket on which the server will listen for client requests
 	sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -25,6 +26,8 @@
 
 #define	MAXLINE		512  //Maximum size of data received in DG
 #define	SERV_PORT	9877 //port on which server is listening
+#define	SESSION_IDLE_TIMEOUT	60 //seconds a server session is kept open waiting for the next file
+#define	RECV_WINDOW	64   //data packets the server can queue per session, the largest window
 //#define DEBUGTRACE //uncomment to print debug traces
 
 //operation codes exchanged between server and client
@@ -33,7 +36,17 @@ enum OPCODE
 	WRITEREQ =0,
 	DATA,
 	ACK,
-	END
+	END,
+	CLOSE, //client is done with the session, server child can exit
+	PROBE  //client asks for the current window after the server closed it
+};
+
+//header for DG
+struct hdr {
+	uint32_t      opcode;         //operation code
+	uint32_t      seq;            //sequence #, in an ack the highest seq received in order
+	uint32_t      ts;             //timestamp when sent
+	uint32_t      win;            //in an ack the number of packets the client may send beyond seq
 };
 
 struct msghdr        msgsend, msgrecv;
@@ -128,6 +141,13 @@ void Fputs(const char *ptr, FILE *stream)
 		bail("fputs error");
 }
 
+//Write nbytes from the buffer pointed by ptr into File stream.
+void Fwrite(const void *ptr, size_t nbytes, FILE *stream)
+{
+	if (fwrite(ptr, 1, nbytes, stream) != nbytes)
+		bail("fwrite error");
+}
+
 //Open a file name in the mode specified by the caller.
 FILE * Fopen(const char *filename, const char *mode)
 {